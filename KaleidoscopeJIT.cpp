@@ -1,8 +1,64 @@
 #include "KaleidoscopeJIT.h"
 
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+
+#include <mutex>
+
 namespace llvm {
 namespace orc {
 
+// Writes /tmp/perf-<pid>.map, which perf reads without needing the
+// jitdump + perf inject step.
+class PerfMapListener : public JITEventListener {
+private:
+    std::mutex lock;
+    std::unique_ptr<raw_fd_ostream> os;
+
+public:
+    PerfMapListener() {
+        std::error_code ec;
+        std::string path = "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+        os = std::make_unique<raw_fd_ostream>(path, ec, sys::fs::OF_Text);
+        if (ec)
+            os.reset();
+    }
+
+    void notifyObjectLoaded(ObjectKey, const object::ObjectFile &obj,
+            const RuntimeDyld::LoadedObjectInfo &info) override {
+        if (!os)
+            return;
+
+        // the debug copy has symbol addresses relocated to where they were loaded
+        object::OwningBinary<object::ObjectFile> debugObj = info.getObjectForDebug(obj);
+        const object::ObjectFile &loaded = debugObj.getBinary() ? *debugObj.getBinary() : obj;
+
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &symSize : object::computeSymbolSizes(loaded)) {
+            object::SymbolRef sym = symSize.first;
+            Expected<object::SymbolRef::Type> type = sym.getType();
+            if (!type) {
+                consumeError(type.takeError());
+                continue;
+            }
+            if (*type != object::SymbolRef::ST_Function)
+                continue;
+
+            Expected<StringRef> name = sym.getName();
+            Expected<uint64_t> addr = sym.getAddress();
+            if (!name || !addr) {
+                consumeError(name.takeError());
+                consumeError(addr.takeError());
+                continue;
+            }
+            *os << format("%llx %llx %s\n", (unsigned long long)*addr,
+                          (unsigned long long)symSize.second, name->str().c_str());
+        }
+        os->flush();
+    }
+};
+
 KaleidoscopeJIT::KaleidoscopeJIT(std::unique_ptr<ExecutionSession> es,
         JITTargetMachineBuilder jtmb, DataLayout dl)
     : es(std::move(es)),
@@ -14,7 +70,7 @@ KaleidoscopeJIT::KaleidoscopeJIT(std::unique_ptr<ExecutionSession> es,
     mainJD(this->es->createBareJITDylib("<main>")) {
         mainJD.addGenerator(
             cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
-                dl.getGlobalPrefix())));
+                this->dl.getGlobalPrefix())));
 }
 
 KaleidoscopeJIT::~KaleidoscopeJIT() {
@@ -22,8 +78,11 @@ KaleidoscopeJIT::~KaleidoscopeJIT() {
         es->reportError(std::move(err));
 }
 
-Expected<std::unique_ptr<KaleidoscopeJIT>> KaleidoscopeJIT::Create() {
-    auto epc = SelfExecutorProcessControl::Create();
+Expected<std::unique_ptr<KaleidoscopeJIT>> KaleidoscopeJIT::Create(bool concurrent) {
+    std::unique_ptr<TaskDispatcher> dispatcher;
+    if (concurrent)
+        dispatcher = std::make_unique<DynamicThreadPoolTaskDispatcher>();
+    auto epc = SelfExecutorProcessControl::Create(nullptr, std::move(dispatcher));
     if (!epc)
         return epc.takeError();
 
@@ -44,7 +103,29 @@ const DataLayout &KaleidoscopeJIT::getDataLayout() const { return dl; }
 
 JITDylib &KaleidoscopeJIT::getMainJITDylib() { return mainJD; }
 
-Error KaleidoscopeJIT::addModule(ThreadSafeModule tsm, ResourceTrackerSP rt = nullptr) {
+// Both must be enabled before the first module is added.
+void KaleidoscopeJIT::enableGDBListener() {
+    // the GDB listener is a process-wide singleton, not owned here
+    objectLayer.setProcessAllSections(true);
+    objectLayer.registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
+}
+
+void KaleidoscopeJIT::enablePerfListeners() {
+    listeners.push_back(std::make_unique<PerfMapListener>());
+    // jitdump support is only there if LLVM was built with LLVM_USE_PERF
+    if (JITEventListener *jitdump = JITEventListener::createPerfJITEventListener())
+        listeners.emplace_back(jitdump);
+    for (auto &l : listeners)
+        objectLayer.registerJITEventListener(*l);
+}
+
+// Makes a host function callable from JIT'd code under the given name.
+Error KaleidoscopeJIT::defineSymbol(StringRef name, JITTargetAddress addr) {
+    return mainJD.define(absoluteSymbols({{mangle(name.str()),
+        JITEvaluatedSymbol(addr, JITSymbolFlags::Exported | JITSymbolFlags::Callable)}}));
+}
+
+Error KaleidoscopeJIT::addModule(ThreadSafeModule tsm, ResourceTrackerSP rt) {
     if (!rt)
         rt = mainJD.getDefaultResourceTracker();
     return compileLayer.add(rt, std::move(tsm));
@@ -54,5 +135,44 @@ Expected<JITEvaluatedSymbol> KaleidoscopeJIT::lookup(StringRef name) {
     return es->lookup({&mainJD}, mangle(name.str()));
 }
 
+// resolves every name in a single session lookup
+Expected<std::vector<JITEvaluatedSymbol>> KaleidoscopeJIT::lookup(ArrayRef<std::string> names) {
+    SymbolLookupSet symbols;
+    std::vector<SymbolStringPtr> mangled;
+    for (auto &name : names) {
+        mangled.push_back(mangle(name));
+        symbols.add(mangled.back());
+    }
+
+    auto result = es->lookup(makeJITDylibSearchOrder(&mainJD), std::move(symbols));
+    if (!result)
+        return result.takeError();
+
+    std::vector<JITEvaluatedSymbol> syms;
+    for (auto &name : mangled)
+        syms.push_back((*result)[name]);
+    return syms;
+}
+
+// Starts compiling names without waiting for it, and calls notifyDone with
+// whether that worked from whichever thread finished. Failures go to the
+// session's error reporter; a later lookup of the same names sees them too.
+void KaleidoscopeJIT::compileInBackground(ArrayRef<std::string> names,
+        unique_function<void(bool)> notifyDone) {
+    SymbolLookupSet symbols;
+    for (auto &name : names)
+        symbols.add(mangle(name));
+
+    es->lookup(LookupKind::Static, makeJITDylibSearchOrder(&mainJD), std::move(symbols),
+        SymbolState::Ready,
+        [this, notifyDone = std::move(notifyDone)](Expected<SymbolMap> result) mutable {
+            bool ok = (bool)result;
+            if (!ok)
+                es->reportError(result.takeError());
+            notifyDone(ok);
+        },
+        NoDependenciesToRegister);
+}
+
 }
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #ifndef KALEIDOSCOPEJIT_H
 #define KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/FunctionExtras.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
@@ -9,6 +12,7 @@
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
@@ -20,6 +24,8 @@ namespace orc {
 class KaleidoscopeJIT {
 private:
     std::unique_ptr<ExecutionSession> es;
+    // declared before objectLayer so they outlive its notifications
+    std::vector<std::unique_ptr<JITEventListener>> listeners;
     RTDyldObjectLinkingLayer objectLayer;
     IRCompileLayer compileLayer;
 
@@ -32,11 +38,17 @@ public:
     KaleidoscopeJIT(std::unique_ptr<ExecutionSession> es,
         JITTargetMachineBuilder jtmb, DataLayout dl);
     ~KaleidoscopeJIT();
-    static Expected<std::unique_ptr<KaleidoscopeJIT>> Create();
+    // concurrent runs compilation on background threads instead of in lookup
+    static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(bool concurrent = false);
     const DataLayout &getDataLayout() const;
     JITDylib &getMainJITDylib();
+    void enableGDBListener();
+    void enablePerfListeners();
+    Error defineSymbol(StringRef name, JITTargetAddress addr);
     Error addModule(ThreadSafeModule tsm, ResourceTrackerSP rt = nullptr);
     Expected<JITEvaluatedSymbol> lookup(StringRef name);
+    Expected<std::vector<JITEvaluatedSymbol>> lookup(ArrayRef<std::string> names);
+    void compileInBackground(ArrayRef<std::string> names, unique_function<void(bool)> notifyDone);
 };
 
 }
@@ -17,6 +17,10 @@ void CallExprAST::accept(ASTVisitor *v) {
     v->visitCallExpr(callee, args);
 }
 
+void SharedExprAST::accept(ASTVisitor *v) {
+    v->visitSharedExpr(expr.get());
+}
+
 void PrototypeAST::accept(ASTVisitor *v) {
     v->visitPrototype(name, args);
 }
@@ -27,4 +31,16 @@ void FunctionAST::accept(ASTVisitor *v) {
 
 std::string PrototypeAST::getName() {
     return name;
+}
+
+const std::vector<std::string> &PrototypeAST::getArgs() {
+    return args;
+}
+
+int PrototypeAST::getLine() {
+    return line;
+}
+
+PrototypeAST *FunctionAST::getProto() {
+    return proto.get();
 }
\ No newline at end of file
@@ -9,6 +9,13 @@
 
 class ASTVisitor;
 
+// the one type every value has in compiled code
+enum NumericMode {
+    num_f64,
+    num_f32,
+    num_i64
+};
+
 class AST {
 public:
     virtual ~AST() {}
@@ -49,6 +56,14 @@ public:
     void accept(ASTVisitor *v) override;
 };
 
+// A subexpression that occurs more than once in a body, see hashcons.h
+class SharedExprAST : public ExprAST {
+    std::shared_ptr<ExprAST> expr;
+public:
+    SharedExprAST(std::shared_ptr<ExprAST> expr) : expr(std::move(expr)) {}
+    void accept(ASTVisitor *v) override;
+};
+
 class DeclAST : public AST {
 public:
     void accept(ASTVisitor *v) = 0;
@@ -57,10 +72,13 @@ public:
 class PrototypeAST : public DeclAST {
     std::string name;
     std::vector<std::string> args;
+    int line;
 public:
-    PrototypeAST(const std::string &name, std::vector<std::string> args) : name(name), args(std::move(args)) {}
+    PrototypeAST(const std::string &name, std::vector<std::string> args, int line = 0) : name(name), args(std::move(args)), line(line) {}
     void accept(ASTVisitor *v) override;
     std::string getName();
+    const std::vector<std::string> &getArgs();
+    int getLine();
 };
 
 class FunctionAST : public DeclAST {
@@ -69,6 +87,7 @@ class FunctionAST : public DeclAST {
 public:
     FunctionAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body) : proto(std::move(proto)), body(std::move(body)) {}
     void accept(ASTVisitor *v) override;
+    PrototypeAST *getProto();
 };
 
 #endif
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "ast.h"
 #include "error.h"
 #include "codegen.h"
+#include "profile.h"
+#include "parallel.h"
 
 #include <string>
 #include <vector>
@@ -9,6 +11,7 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Verifier.h"
 
 using namespace llvm;
@@ -19,6 +22,81 @@ CodeGenerator::CodeGenerator(std::string moduleID) {
     builder = std::make_unique<IRBuilder<>>(*context);
 }
 
+void CodeGenerator::setPrelude(const SnapshotReader *reader) {
+    prelude = reader;
+}
+
+void CodeGenerator::setNumericMode(NumericMode mode) {
+    numeric = mode;
+}
+
+Type *CodeGenerator::getNumericType() {
+    switch (numeric) {
+        case num_f32:
+            return Type::getFloatTy(*context);
+        case num_i64:
+            return Type::getInt64Ty(*context);
+        default:
+            return Type::getDoubleTy(*context);
+    }
+}
+
+void CodeGenerator::setPrototypes(const std::map<std::string, std::unique_ptr<PrototypeAST>> *protos) {
+    prototypes = protos;
+}
+
+void CodeGenerator::setExterns(const StringSet<> *names) {
+    externs = names;
+}
+
+void CodeGenerator::enableDebugInfo(const std::string &filename) {
+    module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+    dbuilder = std::make_unique<DIBuilder>(*module);
+    diFile = dbuilder->createFile(filename, ".");
+    dbuilder->createCompileUnit(dwarf::DW_LANG_C, diFile, "Kaleidoscope Compiler",
+                                /*isOptimized=*/false, "", 0);
+}
+
+void CodeGenerator::enableProfiling() {
+    profiling = true;
+}
+
+// Line info is per definition: every instruction is attributed to the
+// line of its 'def', which is enough for profilers to tell functions apart.
+void CodeGenerator::emitDebugInfo(Function *f, PrototypeAST *proto) {
+    DIType *numTy;
+    switch (numeric) {
+        case num_f32:
+            numTy = dbuilder->createBasicType("float", 32, dwarf::DW_ATE_float);
+            break;
+        case num_i64:
+            numTy = dbuilder->createBasicType("long", 64, dwarf::DW_ATE_signed);
+            break;
+        default:
+            numTy = dbuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+    }
+    SmallVector<Metadata *, 8> types(f->arg_size() + 1, numTy);
+    DISubroutineType *fnTy = dbuilder->createSubroutineType(
+        dbuilder->getOrCreateTypeArray(types));
+
+    unsigned line = proto->getLine();
+    DISubprogram *sp = dbuilder->createFunction(
+        diFile, f->getName(), StringRef(), diFile, line, fnTy, line,
+        DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    f->setSubprogram(sp);
+    builder->SetCurrentDebugLocation(DILocation::get(*context, line, 0, sp));
+}
+
+Module &CodeGenerator::getModule() {
+    return *module;
+}
+
+orc::ThreadSafeModule CodeGenerator::takeModule() {
+    if (dbuilder)
+        dbuilder->finalize();
+    return orc::ThreadSafeModule(std::move(module), std::move(context));
+}
+
 // // LLVM IR Generation
 
 void CodeGenerator::logErrorV(const char *str) {
@@ -31,11 +109,89 @@ void CodeGenerator::logErrorF(const char *str) {
     funStack.push(nullptr);
 }
 
+Function *CodeGenerator::getFunction(const std::string &name) {
+    if (Function *f = module->getFunction(name))
+        return f;
+
+    if (prototypes) {
+        auto proto = prototypes->find(name);
+        if (proto != prototypes->end()) {
+            declaringExtern = externs && externs->count(name);
+            proto->second->accept(this);
+            declaringExtern = false;
+            Function *f = funStack.top();
+            funStack.pop();
+            return f;
+        }
+    }
+
+    if (!prelude)
+        return nullptr;
+    auto decl = prelude->load(name);
+    if (!decl)
+        return nullptr;
+
+    // emitting the prelude function moves the builder, so save our place
+    BasicBlock *insertBlock = builder->GetInsertBlock();
+    DebugLoc loc = builder->getCurrentDebugLocation();
+    auto savedValues = namedValues;
+    auto savedShared = sharedValues;
+    // a bare prototype in the prelude is an extern
+    declaringExtern = true;
+    Function *f = codegen(decl.get());
+    declaringExtern = false;
+    if (insertBlock)
+        builder->SetInsertPoint(insertBlock);
+    builder->SetCurrentDebugLocation(loc);
+    namedValues = savedValues;
+    sharedValues = savedShared;
+    return f;
+}
+
+// Parallel builtins take a function name as their first argument, which
+// is codegen'd with wantFunctionRef set. Anything but a variable is an error.
+bool CodeGenerator::rejectFunctionRef() {
+    if (!wantFunctionRef)
+        return false;
+    wantFunctionRef = false;
+    logErrorV("Expected a function name");
+    return true;
+}
+
 void CodeGenerator::visitNumberExpr(double val) {
-    valStack.push(ConstantFP::get(*context, APFloat(val)));
+    if (rejectFunctionRef())
+        return;
+    if (numeric == num_i64) {
+        // also false for NaN
+        if (!(val >= -9223372036854775808.0 && val < 9223372036854775808.0)) {
+            logErrorV("Number literal out of range for i64");
+            return;
+        }
+        valStack.push(ConstantInt::get(getNumericType(), (int64_t)val, true));
+    } else
+        valStack.push(ConstantFP::get(getNumericType(), val));
 }
 
 void CodeGenerator::visitVariableExpr(std::string name) {
+    if (wantFunctionRef) {
+        wantFunctionRef = false;
+        Function *f = getFunction(name);
+        if (!f) {
+            logErrorV("Unknown function referenced");
+            return;
+        }
+        if (f->arg_size() != 1) {
+            logErrorV("Parallel builtins take a function of one argument");
+            return;
+        }
+        if (f->getReturnType() != getNumericType()) {
+            logErrorV("Parallel builtins cannot call a double extern in this numeric mode");
+            return;
+        }
+        valStack.push(f);
+        return;
+    }
+
     Value *v = namedValues[name];
     if (!v)
         logError("Unknown variable name");
@@ -43,6 +199,9 @@ void CodeGenerator::visitVariableExpr(std::string name) {
 }
 
 void CodeGenerator::visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) {
+    if (rejectFunctionRef())
+        return;
+
     lhs->accept(this);
     rhs->accept(this);
 
@@ -56,6 +215,27 @@ void CodeGenerator::visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) {
         return;
     }
 
+    if (numeric == num_i64) {
+        switch(op) {
+            case '+':
+                valStack.push(builder->CreateAdd(l, r, "addtmp"));
+                return;
+            case '-':
+                valStack.push(builder->CreateSub(l, r, "subtmp"));
+                return;
+            case '*':
+                valStack.push(builder->CreateMul(l, r, "multmp"));
+                return;
+            case '<':
+                l = builder->CreateICmpSLT(l, r, "cmptmp");
+                valStack.push(builder->CreateZExt(l, getNumericType(), "booltmp"));
+                return;
+            default:
+                logErrorV("invalid binary operator");
+        }
+        return;
+    }
+
     switch(op) {
         case '+':
             valStack.push(builder->CreateFAdd(l, r, "addtmp"));
@@ -68,7 +248,7 @@ void CodeGenerator::visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) {
             return;
         case '<':
             l = builder->CreateFCmpULT(l, r, "cmptmp");
-            valStack.push(builder->CreateUIToFP(l, llvm::Type::getDoubleTy(*context), "booltmp"));
+            valStack.push(builder->CreateUIToFP(l, getNumericType(), "booltmp"));
             return;
         default:
             logErrorV("invalid binary operator");
@@ -76,7 +256,15 @@ void CodeGenerator::visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) {
 }
 
 void CodeGenerator::visitCallExpr(std::string callee, const std::vector<std::unique_ptr<ExprAST>> &args) {
-    llvm::Function *calleeF = module->getFunction(callee);
+    if (rejectFunctionRef())
+        return;
+
+    if (callee == parallelSumSymbol || callee == parallelMapSymbol) {
+        visitParallelCall(callee, args);
+        return;
+    }
+
+    llvm::Function *calleeF = getFunction(callee);
     if (!calleeF) {
         logErrorV("Unknown function referenced");
         return;
@@ -93,18 +281,81 @@ void CodeGenerator::visitCallExpr(std::string callee, const std::vector<std::uni
         args[i]->accept(this);
         argsV.push_back(valStack.top());
         valStack.pop();
-        if (!argsV.back())
+        if (!argsV.back()) {
+            valStack.push(nullptr);
+            return;
+        }
+        argsV.back() = convertNumber(argsV.back(), calleeF->getArg(i)->getType());
+    }
+
+    Value *result = builder->CreateCall(calleeF, argsV, "calltmp");
+    valStack.push(convertNumber(result, getNumericType()));
+}
+
+// Between the numeric mode's type and an extern's double. Out of range
+// doubles saturate when converted to i64, and NaN becomes 0.
+Value *CodeGenerator::convertNumber(Value *v, Type *to) {
+    Type *from = v->getType();
+    if (from == to)
+        return v;
+    if (from->isIntegerTy())
+        return builder->CreateSIToFP(v, to, "convtmp");
+    if (to->isIntegerTy())
+        return builder->CreateIntrinsic(Intrinsic::fptosi_sat, {to, from}, {v}, nullptr, "convtmp");
+    if (from->getPrimitiveSizeInBits() < to->getPrimitiveSizeInBits())
+        return builder->CreateFPExt(v, to, "convtmp");
+    return builder->CreateFPTrunc(v, to, "convtmp");
+}
+
+// Bodies are a single basic block, so the first value emitted for a
+// shared node dominates every later use of it.
+void CodeGenerator::visitSharedExpr(ExprAST *expr) {
+    if (wantFunctionRef) {
+        expr->accept(this);
+        return;
+    }
+
+    auto cached = sharedValues.find(expr);
+    if (cached != sharedValues.end()) {
+        valStack.push(cached->second);
+        return;
+    }
+
+    expr->accept(this);
+    sharedValues[expr] = valStack.top();
+}
+
+/// parallelcall ::= ('parallel_sum' | 'parallel_map') '(' identifier ',' expression ',' expression ')'
+void CodeGenerator::visitParallelCall(const std::string &callee, const std::vector<std::unique_ptr<ExprAST>> &args) {
+    if (args.size() != 3) {
+        logErrorV("Incorrect # arguments passed");
+        return;
+    }
+
+    std::vector<llvm::Value *> argsV;
+    for (unsigned i = 0, e = args.size(); i != e; ++i) {
+        wantFunctionRef = i == 0;
+        args[i]->accept(this);
+        argsV.push_back(valStack.top());
+        valStack.pop();
+        if (!argsV.back()) {
             valStack.push(nullptr);
             return;
+        }
     }
 
-    valStack.push(builder->CreateCall(calleeF, argsV, "calltmp"));
+    Type *numTy = getNumericType();
+    FunctionType *bodyTy = FunctionType::get(numTy, {numTy}, false);
+    FunctionCallee builtin = module->getOrInsertFunction(callee, numTy,
+        PointerType::getUnqual(bodyTy), numTy, numTy);
+    valStack.push(builder->CreateCall(builtin, argsV, "partmp"));
 }
 
 void CodeGenerator::visitPrototype(std::string name, const std::vector<std::string> &args) {
-    std::vector<Type *> doubles(args.size(), Type::getDoubleTy(*context));
+    Type *numTy = declaringExtern ? Type::getDoubleTy(*context) : getNumericType();
+    std::vector<Type *> params(args.size(), numTy);
 
-    FunctionType *ft = FunctionType::get(Type::getDoubleTy(*context), doubles, false);
+    FunctionType *ft = FunctionType::get(numTy, params, false);
 
     Function *f = Function::Create(ft, Function::ExternalLinkage, name, module.get());
 
@@ -115,14 +366,14 @@ void CodeGenerator::visitPrototype(std::string name, const std::vector<std::stri
     funStack.push(f);
 }
 
-#include <iostream>
-
 void CodeGenerator::visitFunction(PrototypeAST *proto, ExprAST *body) {
     Function *f = module->getFunction(proto->getName());
 
     // TODO fix diff param names bug???
 
     if (!f) {
+        // a definition, even when reached while declaring a prelude extern
+        declaringExtern = false;
         proto->accept(this);
         f = funStack.top();
         funStack.pop();
@@ -134,14 +385,24 @@ void CodeGenerator::visitFunction(PrototypeAST *proto, ExprAST *body) {
     }
 
     if (!f->empty()) {
-        std::cout << "redefined" << std::endl;
         logErrorF("Function cannot be redefined.");
+        return;
     }
     
     BasicBlock *bb = BasicBlock::Create(*context, "entry", f);
     builder->SetInsertPoint(bb);
+    if (dbuilder)
+        emitDebugInfo(f, proto);
+
+    Value *profileStart = nullptr;
+    if (profiling) {
+        FunctionCallee enter = module->getOrInsertFunction(profileEnterSymbol,
+            Type::getInt64Ty(*context));
+        profileStart = builder->CreateCall(enter, {}, "profstart");
+    }
 
     namedValues.clear();
+    sharedValues.clear();
     for (auto &arg : f->args())
         namedValues[arg.getName().str()] = &arg;
 
@@ -150,12 +411,20 @@ void CodeGenerator::visitFunction(PrototypeAST *proto, ExprAST *body) {
     valStack.pop();
 
     if (retVal) {
+        if (profileStart) {
+            FunctionCallee exit = module->getOrInsertFunction(profileExitSymbol,
+                Type::getVoidTy(*context), Type::getInt64Ty(*context), Type::getInt64Ty(*context));
+            Value *id = builder->getInt64(registerProfiledFunction(proto->getName()));
+            builder->CreateCall(exit, {id, profileStart});
+        }
         builder->CreateRet(retVal);
+        builder->SetCurrentDebugLocation(DebugLoc());
         verifyFunction(*f);
         funStack.push(f);
         return;
     }
 
+    builder->SetCurrentDebugLocation(DebugLoc());
     f->eraseFromParent();
     funStack.push(nullptr);
 }
@@ -1,9 +1,13 @@
 #include "visitor.h"
+#include "snapshot.h"
 
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ADT/StringSet.h"
 
 #include <stack>
 
@@ -14,16 +18,54 @@ class CodeGenerator : public ASTVisitor {
         std::unique_ptr<LLVMContext> context;
         std::unique_ptr<IRBuilder<>> builder;
         std::unique_ptr<Module> module;
+        NumericMode numeric = num_f64;
+        Type *getNumericType();
         std::map<std::string, Value *> namedValues;
+        // values of shared subexpressions in the current function
+        std::map<ExprAST *, Value *> sharedValues;
+
+        // declarations loaded lazily on first call
+        const SnapshotReader *prelude = nullptr;
+
+        // functions compiled into other modules, declared on first call
+        const std::map<std::string, std::unique_ptr<PrototypeAST>> *prototypes = nullptr;
+
+        // Externs are host C functions and keep the double signature in
+        // every numeric mode; calls convert at the call site.
+        const StringSet<> *externs = nullptr;
+        bool declaringExtern = false;
+        Value *convertNumber(Value *v, Type *to);
+
+        // only set when debug info is enabled
+        std::unique_ptr<DIBuilder> dbuilder;
+        DIFile *diFile = nullptr;
+        void emitDebugInfo(Function *f, PrototypeAST *proto);
+
+        // wrap each function in calls to the profiling runtime
+        bool profiling = false;
 
         void logErrorV(const char *str);
         void logErrorF(const char *str);
+        Function *getFunction(const std::string &name);
+
+        // set while codegen'ing the function argument of a parallel builtin
+        bool wantFunctionRef = false;
+        bool rejectFunctionRef();
+        void visitParallelCall(const std::string &callee, const std::vector<std::unique_ptr<ExprAST>> &args);
 
         // store intermediate results
         std::stack<Value *> valStack;
         std::stack<Function *> funStack;
     public:
         CodeGenerator(std::string moduleID);
+        void setNumericMode(NumericMode mode);
+        void setPrelude(const SnapshotReader *reader);
+        void setPrototypes(const std::map<std::string, std::unique_ptr<PrototypeAST>> *protos);
+        void setExterns(const StringSet<> *names);
+        void enableDebugInfo(const std::string &filename);
+        void enableProfiling();
+        Module &getModule();
+        orc::ThreadSafeModule takeModule();
         Function *codegen(DeclAST *ast);
         Value *codegen(ExprAST *ast);
 
@@ -31,6 +73,7 @@ class CodeGenerator : public ASTVisitor {
         void visitVariableExpr(std::string name) override;
         void visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) override;
         void visitCallExpr(std::string callee, const std::vector<std::unique_ptr<ExprAST>> &args) override;
+        void visitSharedExpr(ExprAST *expr) override;
         void visitPrototype(std::string name, const std::vector<std::string> &args) override;
         void visitFunction(PrototypeAST *proto, ExprAST *body) override;
 };
\ No newline at end of file
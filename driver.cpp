@@ -1,24 +1,101 @@
 #include "parser.h"
-#include "codegen.h"
+#include "kaleidoscope.h"
 #include "error.h"
+#include "snapshot.h"
+#include "parallel.h"
 
-#include "llvm/IR/Value.h"
+#include "llvm/Support/CommandLine.h"
 
 using namespace llvm;
 
-static std::unique_ptr<CodeGenerator> cg;
+static cl::opt<std::string> EmitSnapshot("emit-snapshot",
+    cl::desc("Write parsed definitions and externs to a snapshot file"),
+    cl::value_desc("file"));
 
-static void InitializeModule() {
-    cg = std::make_unique<CodeGenerator>("jasper module");
+static cl::opt<std::string> Prelude("prelude",
+    cl::desc("Load definitions lazily from a snapshot file"),
+    cl::value_desc("file"));
+
+static cl::opt<bool> JITGDB("jit-gdb",
+    cl::desc("Register JIT'd code with GDB"));
+
+static cl::opt<bool> JITPerf("jit-perf",
+    cl::desc("Write a perf map and jitdump for JIT'd code"));
+
+static cl::opt<bool> DebugInfo("g",
+    cl::desc("Emit line info for each definition"));
+
+static cl::opt<bool> Profile("profile",
+    cl::desc("Count calls and time every function (see :profile)"));
+
+static cl::opt<bool> HashCons("hashcons",
+    cl::desc("Merge repeated subexpressions before codegen"));
+
+static cl::opt<NumericMode> Numeric("numeric",
+    cl::desc("Type of every value in compiled code"),
+    cl::values(clEnumValN(num_f64, "f64", "double (default)"),
+               clEnumValN(num_f32, "f32", "float"),
+               clEnumValN(num_i64, "i64", "64-bit signed integer")),
+    cl::init(num_f64));
+
+static cl::opt<bool> Pipeline("pipeline",
+    cl::desc("Keep parsing while earlier input is compiled and run"));
+
+static std::unique_ptr<Kaleidoscope> ks;
+static std::unique_ptr<SnapshotWriter> snapshot;
+
+// With -pipeline the main thread only parses. Everything that touches ks is
+// queued on compileQueue in input order, and expressions are then run on
+// evalQueue, so each waits for the definitions it calls and nothing else.
+static std::unique_ptr<SerialQueue> compileQueue;
+static std::unique_ptr<SerialQueue> evalQueue;
+
+static void Compile(std::function<void()> job) {
+    if (compileQueue)
+        compileQueue->post(std::move(job));
+    else
+        job();
+}
+
+// Only called from a Compile job, which keeps runs in input order.
+static void Run(std::function<void()> job) {
+    if (evalQueue)
+        evalQueue->post(std::move(job));
+    else
+        job();
+}
+
+static bool InitializeJIT() {
+    KaleidoscopeOptions options;
+    options.gdbListener = JITGDB;
+    options.perfListeners = JITPerf;
+    options.debugInfo = DebugInfo;
+    options.profile = Profile;
+    options.hashcons = HashCons;
+    options.numeric = Numeric;
+    options.printIR = true;
+    options.sourceName = "<stdin>";
+    options.concurrentCompile = Pipeline;
+
+    auto created = Kaleidoscope::Create(options);
+    if (!created) {
+        logError(toString(created.takeError()).c_str());
+        return false;
+    }
+    ks = std::move(*created);
+    return true;
 }
 
 static void HandleDefinition() {
     if (auto FnAST = parseDefinition()) {
-        if (auto *FnIR = cg->codegen(FnAST.get())) {
+        if (snapshot)
+            snapshot->add(FnAST.get());
         fprintf(stderr, "Read function definition:\n");
-        FnIR->print(errs());
-        fprintf(stderr, "\n");
-        }
+        auto fn = std::make_shared<std::unique_ptr<FunctionAST>>(std::move(FnAST));
+        Compile([fn] {
+            if (auto err = ks->addFunction(std::move(*fn)))
+                logError(toString(std::move(err)).c_str());
+        });
     } else {
         // Skip token for error recovery.
         getNextToken();
@@ -27,11 +104,14 @@ static void HandleDefinition() {
 
 static void HandleExtern() {
   if (auto ProtoAST = parseExtern()) {
-    if (auto *FnIR = cg->codegen(ProtoAST.get())) {
-      fprintf(stderr, "Read extern:\n");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-    }
+    if (snapshot)
+      snapshot->add(ProtoAST.get());
+    fprintf(stderr, "Read extern: %s\n", ProtoAST->getName().c_str());
+    auto proto = std::make_shared<std::unique_ptr<PrototypeAST>>(std::move(ProtoAST));
+    Compile([proto] {
+      if (auto err = ks->addExtern(std::move(*proto)))
+        logError(toString(std::move(err)).c_str());
+    });
   } else {
     // Skip token for error recovery.
     getNextToken();
@@ -41,21 +121,49 @@ static void HandleExtern() {
 static void HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
   if (auto FnAST = parseTopLevelExpr()) {
-    if (auto *FnIR = cg->codegen(FnAST.get())) {
-      fprintf(stderr, "Read top-level expression:\n");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-
-      // Remove the anonymous expression.
-      FnIR->eraseFromParent();
-    }
+    fprintf(stderr, "Read top-level expression:\n");
+    auto fn = std::make_shared<std::unique_ptr<FunctionAST>>(std::move(FnAST));
+    Compile([fn] {
+      auto pending = ks->addExpression(std::move(*fn));
+      if (!pending) {
+        logError(toString(pending.takeError()).c_str());
+        return;
+      }
+      auto expr = std::make_shared<PendingExpression>(std::move(*pending));
+      Run([expr] {
+        if (auto result = ks->runExpression(std::move(*expr)))
+          fprintf(stderr, "Evaluated to %f\n", *result);
+        else
+          logError(toString(result.takeError()).c_str());
+      });
+    });
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
-/// top ::= definition | external | expression | ';'
+/// command ::= ':profile' | ':profile-json' | ':profile-reset'
+static void HandleCommand() {
+  std::string name = currentIdentifier();
+  getNextToken();
+
+  // counts are only complete once earlier expressions have run
+  Compile([name] {
+    Run([name] {
+      if (name == "profile")
+        printProfile(errs());
+      else if (name == "profile-json")
+        printProfileJSON(outs());
+      else if (name == "profile-reset")
+        resetProfile();
+      else
+        logError("Unknown command");
+    });
+  });
+}
+
+/// top ::= definition | external | expression | command | ';'
 static void MainLoop() {
   while (true) {
     fprintf(stderr, "ready> ");
@@ -71,6 +179,9 @@ static void MainLoop() {
     case tok_extern:
       HandleExtern();
       break;
+    case tok_command:
+      HandleCommand();
+      break;
     default:
       HandleTopLevelExpression();
       break;
@@ -82,19 +193,46 @@ static void MainLoop() {
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
+
     // Prime the first token.
     fprintf(stderr, "ready> ");
     getNextToken();
 
-    // Make the module, which holds all the code.
-    InitializeModule();
+    if (!InitializeJIT())
+        return 1;
+
+    if (!Prelude.empty()) {
+        auto prelude = SnapshotReader::open(Prelude);
+        if (!prelude)
+            return 1;
+        ks->setPrelude(std::move(prelude));
+    }
+
+    if (!EmitSnapshot.empty())
+        snapshot = std::make_unique<SnapshotWriter>();
+
+    if (Pipeline) {
+        compileQueue = std::make_unique<SerialQueue>();
+        evalQueue = std::make_unique<SerialQueue>();
+    }
 
     // Run the main "interpreter loop" now.
     MainLoop();
 
-    // Print out all of the generated code.
-    //   TheModule->print(errs(), nullptr);
+    // compile jobs may still post runs, so drain them first
+    compileQueue.reset();
+    evalQueue.reset();
+
+    if (snapshot && !snapshot->write(EmitSnapshot))
+        return 1;
+
+    if (HashCons) {
+        const HashConsStats &stats = ks->getHashConsStats();
+        fprintf(stderr, "hashcons: %zu -> %zu nodes, ~%zu -> ~%zu bytes\n",
+                stats.nodesBefore, stats.nodesAfter, stats.bytesBefore, stats.bytesAfter);
+    }
 
     return 0;
 }
\ No newline at end of file
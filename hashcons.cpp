@@ -0,0 +1,192 @@
+#include "hashcons.h"
+
+#include <cstring>
+
+// rough size of the control block behind each shared node
+static const size_t sharedOverhead = 2 * sizeof(long);
+
+// Keys are a kind letter, the node's own payload and the ids of its
+// children, so equal keys mean structurally equal subtrees.
+static void appendId(std::string &key, unsigned id) {
+    key.append((const char *)&id, sizeof(id));
+}
+
+unsigned HashConser::idFor(const std::string &key, bool &isNew) {
+    auto entry = ids.emplace(key, (unsigned)refs.size());
+    isNew = entry.second;
+    if (isNew) {
+        refs.push_back(0);
+        sharedNodes.push_back(nullptr);
+    }
+    return entry.first->second;
+}
+
+void HashConser::pushLeaf(const std::string &key, std::unique_ptr<ExprAST> leaf, size_t bytes) {
+    if (counting) {
+        bool isNew;
+        results.push({idFor(key, isNew), nullptr, nullptr});
+        return;
+    }
+    stats.nodesAfter++;
+    stats.bytesAfter += bytes;
+    results.push({visiting, std::move(leaf), nullptr});
+}
+
+// Only the first occurrence of a key adds edges to its children; later
+// ones stand for the same node, and their parents add an edge to it.
+void HashConser::countCompound(const std::string &key, const std::vector<unsigned> &children) {
+    bool isNew;
+    unsigned id = idFor(key, isNew);
+    if (isNew)
+        for (unsigned c : children)
+            refs[c]++;
+    results.push({id, nullptr, nullptr});
+}
+
+void HashConser::pushCompound(unsigned id, std::unique_ptr<ExprAST> node, size_t bytes) {
+    stats.nodesAfter++;
+    if (refs[id] < 2) {
+        stats.bytesAfter += bytes;
+        results.push({id, std::move(node), nullptr});
+        return;
+    }
+    stats.bytesAfter += bytes + sharedOverhead;
+    sharedNodes[id] = std::shared_ptr<ExprAST>(std::move(node));
+    results.push({id, nullptr, sharedNodes[id]});
+}
+
+// Visits a child, except that a shared node is only built the first time.
+HashConser::Result HashConser::child(ExprAST *expr) {
+    if (counting) {
+        expr->accept(this);
+        Result result = pop();
+        nodeIds[expr] = result.id;
+        return result;
+    }
+
+    unsigned id = nodeIds[expr];
+    if (sharedNodes[id])
+        return {id, nullptr, sharedNodes[id]};
+    visiting = id;
+    expr->accept(this);
+    return pop();
+}
+
+HashConser::Result HashConser::pop() {
+    Result result = std::move(results.top());
+    results.pop();
+    return result;
+}
+
+// Turns a child into an owned edge of a new node.
+std::unique_ptr<ExprAST> HashConser::edge(Result result) {
+    if (result.owned)
+        return std::move(result.owned);
+    stats.nodesAfter++;
+    stats.bytesAfter += sizeof(SharedExprAST);
+    return std::make_unique<SharedExprAST>(std::move(result.shared));
+}
+
+void HashConser::visitNumberExpr(double val) {
+    if (counting) {
+        stats.nodesBefore++;
+        stats.bytesBefore += sizeof(NumberExprAST);
+    }
+
+    std::string key = "N";
+    key.append((const char *)&val, sizeof(val));
+    pushLeaf(key, counting ? nullptr : std::make_unique<NumberExprAST>(val), sizeof(NumberExprAST));
+}
+
+void HashConser::visitVariableExpr(std::string name) {
+    size_t bytes = sizeof(VariableExprAST) + name.size();
+    if (counting) {
+        stats.nodesBefore++;
+        stats.bytesBefore += bytes;
+    }
+
+    pushLeaf("V" + name, counting ? nullptr : std::make_unique<VariableExprAST>(name), bytes);
+}
+
+void HashConser::visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) {
+    unsigned id = visiting;
+    Result l = child(lhs);
+    Result r = child(rhs);
+
+    if (counting) {
+        stats.nodesBefore++;
+        stats.bytesBefore += sizeof(BinaryExprAST);
+        std::string key = "B";
+        key += op;
+        appendId(key, l.id);
+        appendId(key, r.id);
+        countCompound(key, {l.id, r.id});
+        return;
+    }
+
+    pushCompound(id, std::make_unique<BinaryExprAST>(op, edge(std::move(l)), edge(std::move(r))),
+                 sizeof(BinaryExprAST));
+}
+
+void HashConser::visitCallExpr(std::string callee, const std::vector<std::unique_ptr<ExprAST>> &args) {
+    unsigned id = visiting;
+    size_t bytes = sizeof(CallExprAST) + callee.size() + args.size() * sizeof(args[0]);
+    std::vector<Result> argResults;
+    for (auto &arg : args)
+        argResults.push_back(child(arg.get()));
+
+    if (counting) {
+        stats.nodesBefore++;
+        stats.bytesBefore += bytes;
+        // names cannot contain '\0', so it ends the callee unambiguously
+        std::string key = "C" + callee + '\0';
+        std::vector<unsigned> children;
+        for (auto &arg : argResults) {
+            appendId(key, arg.id);
+            children.push_back(arg.id);
+        }
+        countCompound(key, children);
+        return;
+    }
+
+    std::vector<std::unique_ptr<ExprAST>> edges;
+    for (auto &arg : argResults)
+        edges.push_back(edge(std::move(arg)));
+    pushCompound(id, std::make_unique<CallExprAST>(callee, std::move(edges)), bytes);
+}
+
+// input that was already hash-consed is treated as a plain tree
+void HashConser::visitSharedExpr(ExprAST *expr) {
+    expr->accept(this);
+}
+
+void HashConser::visitPrototype(std::string, const std::vector<std::string> &) {}
+
+void HashConser::visitFunction(PrototypeAST *proto, ExprAST *body) {
+    Result result = child(body);
+    if (counting) {
+        // the body's edge from the function itself
+        refs[result.id]++;
+        return;
+    }
+    auto newProto = std::make_unique<PrototypeAST>(proto->getName(), proto->getArgs(), proto->getLine());
+    function = std::make_unique<FunctionAST>(std::move(newProto), edge(std::move(result)));
+}
+
+std::unique_ptr<FunctionAST> HashConser::run(std::unique_ptr<FunctionAST> fn) {
+    // sharing stops at function boundaries, like the codegen cache
+    ids.clear();
+    refs.clear();
+    sharedNodes.clear();
+    nodeIds.clear();
+
+    counting = true;
+    fn->accept(this);
+    counting = false;
+    fn->accept(this);
+    return std::move(function);
+}
+
+const HashConsStats &HashConser::getStats() const {
+    return stats;
+}
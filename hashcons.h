@@ -0,0 +1,77 @@
+#ifndef HASHCONS_H
+#define HASHCONS_H
+
+#include "ast.h"
+#include "visitor.h"
+
+#include <memory>
+#include <stack>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Running totals over every function that went through a HashConser.
+// Bytes are estimated from object sizes plus out-of-line names and
+// argument vectors.
+struct HashConsStats {
+    size_t nodesBefore = 0;
+    size_t nodesAfter = 0;
+    size_t bytesBefore = 0;
+    size_t bytesAfter = 0;
+};
+
+// Rewrites a function body into a DAG: binary and call subexpressions that
+// occur more than once become one node, referenced through SharedExprAST,
+// and CodeGenerator emits each of them once per function. Everything else
+// stays a plain tree, and number and variable leaves are never shared.
+//
+// run makes two passes. The first gives structurally equal subtrees the
+// same id and counts the edges into each one; the second builds the
+// result, sharing the ids with at least two edges.
+//
+// Calls are merged too, so this assumes callees are pure. Leave it off for
+// code that relies on repeated calls to side-effecting externs.
+class HashConser : public ASTVisitor {
+    private:
+        // a visited node; in the counting pass only id is set
+        struct Result {
+            unsigned id;
+            std::unique_ptr<ExprAST> owned;
+            std::shared_ptr<ExprAST> shared;
+        };
+
+        bool counting = false;
+        std::unordered_map<std::string, unsigned> ids;
+        // per id: edges into it in the DAG, and the node once built if shared
+        std::vector<unsigned> refs;
+        std::vector<std::shared_ptr<ExprAST>> sharedNodes;
+        // ids of the child pointers seen in the counting pass
+        std::unordered_map<ExprAST *, unsigned> nodeIds;
+        // id of the node about to be visited in the building pass
+        unsigned visiting = 0;
+
+        std::stack<Result> results;
+        std::unique_ptr<FunctionAST> function;
+        HashConsStats stats;
+
+        unsigned idFor(const std::string &key, bool &isNew);
+        void pushLeaf(const std::string &key, std::unique_ptr<ExprAST> leaf, size_t bytes);
+        void countCompound(const std::string &key, const std::vector<unsigned> &children);
+        void pushCompound(unsigned id, std::unique_ptr<ExprAST> node, size_t bytes);
+        Result child(ExprAST *expr);
+        Result pop();
+        std::unique_ptr<ExprAST> edge(Result result);
+    public:
+        std::unique_ptr<FunctionAST> run(std::unique_ptr<FunctionAST> fn);
+        const HashConsStats &getStats() const;
+
+        void visitNumberExpr(double val) override;
+        void visitVariableExpr(std::string name) override;
+        void visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) override;
+        void visitCallExpr(std::string callee, const std::vector<std::unique_ptr<ExprAST>> &args) override;
+        void visitSharedExpr(ExprAST *expr) override;
+        void visitPrototype(std::string name, const std::vector<std::string> &args) override;
+        void visitFunction(PrototypeAST *proto, ExprAST *body) override;
+};
+
+#endif
@@ -0,0 +1,421 @@
+#include "kaleidoscope.h"
+#include "codegen.h"
+#include "parser.h"
+#include "parallel.h"
+
+#include "llvm/Support/TargetSelect.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static Error makeError(const Twine &msg) {
+    return make_error<StringError>(msg, inconvertibleErrorCode());
+}
+
+static const char *numericModeName(NumericMode mode) {
+    switch (mode) {
+        case num_f32:
+            return "f32";
+        case num_i64:
+            return "i64";
+        default:
+            return "f64";
+    }
+}
+
+// binds the builtin names to the instances for the engine's number type
+template <typename T>
+static Error defineParallelBuiltins(KaleidoscopeJIT &jit) {
+    if (auto err = jit.defineSymbol(parallelSumSymbol, pointerToJITTargetAddress(&parallelSum<T>)))
+        return err;
+    return jit.defineSymbol(parallelMapSymbol, pointerToJITTargetAddress(&parallelMap<T>));
+}
+
+static Error defineParallelBuiltins(KaleidoscopeJIT &jit, NumericMode mode) {
+    switch (mode) {
+        case num_f32:
+            return defineParallelBuiltins<float>(jit);
+        case num_i64:
+            return defineParallelBuiltins<int64_t>(jit);
+        default:
+            return defineParallelBuiltins<double>(jit);
+    }
+}
+
+Kaleidoscope::Kaleidoscope(std::unique_ptr<KaleidoscopeJIT> jit, KaleidoscopeOptions options)
+    : options(std::move(options)), jit(std::move(jit)) {}
+
+Expected<std::unique_ptr<Kaleidoscope>> Kaleidoscope::Create(KaleidoscopeOptions options) {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    auto jit = KaleidoscopeJIT::Create(options.concurrentCompile);
+    if (!jit)
+        return jit.takeError();
+
+    if (options.gdbListener)
+        (*jit)->enableGDBListener();
+    if (options.perfListeners)
+        (*jit)->enablePerfListeners();
+
+    if (auto err = (*jit)->defineSymbol(profileEnterSymbol, pointerToJITTargetAddress(&profileEnter)))
+        return std::move(err);
+    if (auto err = (*jit)->defineSymbol(profileExitSymbol, pointerToJITTargetAddress(&profileExit)))
+        return std::move(err);
+    if (auto err = defineParallelBuiltins(**jit, options.numeric))
+        return std::move(err);
+
+    return std::make_unique<Kaleidoscope>(std::move(*jit), std::move(options));
+}
+
+void Kaleidoscope::setPrelude(std::unique_ptr<SnapshotReader> reader) {
+    prelude = std::move(reader);
+}
+
+std::unique_ptr<CodeGenerator> Kaleidoscope::newCodeGenerator() {
+    auto cg = std::make_unique<CodeGenerator>("ks module " + std::to_string(moduleCount++));
+    cg->setNumericMode(options.numeric);
+    cg->setPrototypes(&prototypes);
+    cg->setExterns(&externs);
+    cg->setPrelude(prelude.get());
+    if (options.debugInfo)
+        cg->enableDebugInfo(options.sourceName);
+    if (options.profile)
+        cg->enableProfiling();
+    return cg;
+}
+
+// Hands the module over to the JIT. Functions the module picked up from the
+// prelude are recorded in prototypes and appended to defined, if given.
+Error Kaleidoscope::addModule(CodeGenerator &cg, ResourceTrackerSP rt,
+                              std::vector<std::string> *defined) {
+    auto tsm = cg.takeModule();
+    tsm.withModuleDo([&](Module &m) {
+        m.setDataLayout(jit->getDataLayout());
+        if (options.printIR)
+            for (Function &f : m)
+                if (!f.isDeclaration())
+                    f.print(errs());
+
+        if (!defined)
+            return;
+        for (Function &f : m) {
+            std::string name = f.getName().str();
+            if (f.isDeclaration() || prototypes.count(name))
+                continue;
+            std::vector<std::string> args;
+            for (auto &arg : f.args())
+                args.push_back(arg.getName().str());
+            prototypes[name] = std::make_unique<PrototypeAST>(name, std::move(args));
+            defined->push_back(name);
+        }
+    });
+    return jit->addModule(std::move(tsm), rt);
+}
+
+Error Kaleidoscope::compile(const std::string &source) {
+    return compile(makeArrayRef(source));
+}
+
+Error Kaleidoscope::compile(ArrayRef<std::string> sources) {
+    std::vector<std::unique_ptr<FunctionAST>> functions;
+    std::vector<std::string> added;
+
+    auto fail = [&](const Twine &msg) {
+        for (auto &name : added) {
+            prototypes.erase(name);
+            externs.erase(name);
+        }
+        return makeError(msg);
+    };
+
+    for (auto &source : sources) {
+        setInputString(source);
+        getNextToken();
+        while (CurTok != tok_eof) {
+            switch (CurTok) {
+            case ';':
+                getNextToken();
+                break;
+            case tok_def:
+                if (auto fn = parseDefinition())
+                    functions.push_back(std::move(fn));
+                else
+                    return fail("parse error in definition");
+                break;
+            case tok_extern: {
+                auto proto = parseExtern();
+                if (!proto)
+                    return fail("parse error in extern");
+                if (auto err = declareExtern(std::move(proto), &added))
+                    return fail(toString(std::move(err)));
+                break;
+            }
+            default:
+                return fail("only definitions and externs can be compiled");
+            }
+        }
+    }
+
+    return compileFunctions(std::move(functions), std::move(added));
+}
+
+// Undoes everything a batch changed; the caller makes sure none of it is
+// in use any more.
+Error Kaleidoscope::rollback(Batch &batch) {
+    for (size_t i = 0; i < batch.unexterned.size(); ++i) {
+        externs.insert(batch.unexterned[i]);
+        prototypes[batch.unexterned[i]] = std::move(batch.replaced[i]);
+    }
+    for (auto &name : batch.added) {
+        prototypes.erase(name);
+        externs.erase(name);
+    }
+    for (auto &name : batch.names)
+        defined.erase(name);
+    if (batch.rt)
+        return batch.rt->remove();
+    return Error::success();
+}
+
+// Forgets background batches that have finished, rolling back the ones
+// that failed. If waitFor is given, first waits for the batch defining it.
+void Kaleidoscope::reapBackground(const std::string *waitFor) {
+    for (auto it = background.begin(); it != background.end();) {
+        BackgroundBatch &bb = **it;
+        std::unique_lock<std::mutex> guard(bb.lock);
+        auto &names = bb.batch.names;
+        if (waitFor && std::find(names.begin(), names.end(), *waitFor) != names.end())
+            bb.finished.wait(guard, [&] { return bb.done; });
+        if (!bb.done) {
+            ++it;
+            continue;
+        }
+        if (bb.failed)
+            logAllUnhandledErrors(rollback(bb.batch), errs());
+        guard.unlock();
+        it = background.erase(it);
+    }
+}
+
+// Compiles functions into one module and resolves them with one lookup.
+// Each batch gets its own tracker, so on failure its code is removed and
+// every prototype named in added is forgotten again. In concurrent mode
+// the lookup finishes later and reapBackground does the same.
+Error Kaleidoscope::compileFunctions(std::vector<std::unique_ptr<FunctionAST>> functions,
+                                     std::vector<std::string> added) {
+    reapBackground();
+
+    Batch batch;
+    batch.added = std::move(added);
+    std::vector<std::string> &names = batch.names;
+    auto fail = [&](Error err) {
+        return joinErrors(std::move(err), rollback(batch));
+    };
+
+    // declare everything up front so the batch may call forwards
+    for (auto &fn : functions) {
+        PrototypeAST *proto = fn->getProto();
+        std::string name = proto->getName();
+        // a failed background batch gives its names back
+        if (defined.count(name))
+            reapBackground(&name);
+        if (defined.count(name) ||
+                std::find(names.begin(), names.end(), name) != names.end())
+            return fail(makeError("redefinition of '" + name + "'"));
+        auto declared = std::make_unique<PrototypeAST>(name, proto->getArgs(), proto->getLine());
+        if (externs.erase(name)) {
+            // externs this batch defines in Kaleidoscope after all
+            batch.unexterned.push_back(name);
+            batch.replaced.push_back(std::move(prototypes[name]));
+            prototypes[name] = std::move(declared);
+        } else if (!prototypes.count(name)) {
+            prototypes[name] = std::move(declared);
+            batch.added.push_back(name);
+        }
+        names.push_back(name);
+    }
+
+    if (functions.empty())
+        return Error::success();
+
+    if (options.hashcons)
+        for (auto &fn : functions)
+            fn = hashConser.run(std::move(fn));
+
+    auto cg = newCodeGenerator();
+    for (auto &fn : functions)
+        if (!cg->codegen(fn.get()))
+            return fail(makeError("could not compile '" + fn->getProto()->getName() + "'"));
+
+    // functions pulled in from the prelude are appended to names
+    size_t ownNames = names.size();
+    batch.rt = jit->getMainJITDylib().createResourceTracker();
+    Error err = addModule(*cg, batch.rt, &names);
+    batch.added.insert(batch.added.end(), names.begin() + ownNames, names.end());
+    if (err)
+        return fail(std::move(err));
+    for (auto &name : names)
+        defined.insert(name);
+
+    // addresses are filled in by getAddress once somebody asks
+    if (options.concurrentCompile) {
+        auto bb = std::make_shared<BackgroundBatch>();
+        bb->batch = std::move(batch);
+        background.push_back(bb);
+        jit->compileInBackground(bb->batch.names, [bb](bool ok) {
+            std::lock_guard<std::mutex> guard(bb->lock);
+            bb->done = true;
+            bb->failed = !ok;
+            bb->finished.notify_all();
+        });
+        return Error::success();
+    }
+
+    auto syms = jit->lookup(names);
+    if (!syms)
+        return fail(syms.takeError());
+    for (size_t i = 0; i < names.size(); ++i)
+        addresses[names[i]] = (*syms)[i].getAddress();
+    // dropping rt hands the code over to the default tracker
+    return Error::success();
+}
+
+Error Kaleidoscope::addFunction(std::unique_ptr<FunctionAST> fn) {
+    std::vector<std::unique_ptr<FunctionAST>> functions;
+    functions.push_back(std::move(fn));
+    return compileFunctions(std::move(functions), {});
+}
+
+Error Kaleidoscope::addExtern(std::unique_ptr<PrototypeAST> proto) {
+    reapBackground();
+    return declareExtern(std::move(proto), nullptr);
+}
+
+// An extern for a name that is already declared, by another extern or a
+// definition, is ignored as long as the arity agrees. New names are
+// appended to added, if given.
+Error Kaleidoscope::declareExtern(std::unique_ptr<PrototypeAST> proto,
+                                  std::vector<std::string> *added) {
+    std::string name = proto->getName();
+    auto existing = prototypes.find(name);
+    if (existing != prototypes.end()) {
+        if (existing->second->getArgs().size() != proto->getArgs().size())
+            return makeError("'" + name + "' is already declared with " +
+                             Twine(existing->second->getArgs().size()) + " arguments");
+        return Error::success();
+    }
+
+    prototypes[name] = std::move(proto);
+    externs.insert(name);
+    if (added)
+        added->push_back(name);
+    return Error::success();
+}
+
+// Runs an anonymous function once and throws its code away again.
+Expected<double> Kaleidoscope::evaluate(std::unique_ptr<FunctionAST> expr) {
+    auto pending = addExpression(std::move(expr));
+    if (!pending)
+        return pending.takeError();
+    return runExpression(std::move(*pending));
+}
+
+// The expression's tracker must own nothing but the anonymous function, so
+// prelude functions it pulls in are compiled for good first, and the
+// expression is then generated again against their declarations.
+Expected<PendingExpression> Kaleidoscope::addExpression(std::unique_ptr<FunctionAST> expr) {
+    reapBackground();
+    if (options.hashcons)
+        expr = hashConser.run(std::move(expr));
+
+    auto cg = newCodeGenerator();
+    Function *f = cg->codegen(expr.get());
+    if (!f)
+        return makeError("could not compile expression");
+
+    std::vector<std::unique_ptr<FunctionAST>> preludeFunctions;
+    for (Function &loaded : cg->getModule())
+        if (&loaded != f && !loaded.isDeclaration()) {
+            // only prelude definitions end up in the module besides f
+            auto decl = prelude->load(loaded.getName());
+            preludeFunctions.emplace_back(static_cast<FunctionAST *>(decl.release()));
+        }
+
+    if (!preludeFunctions.empty()) {
+        if (auto err = compileFunctions(std::move(preludeFunctions), {}))
+            return std::move(err);
+        cg = newCodeGenerator();
+        f = cg->codegen(expr.get());
+        if (!f)
+            return makeError("could not compile expression");
+    }
+
+    std::string name = expr->getProto()->getName() + "." + std::to_string(expressionCount++);
+    f->setName(name);
+
+    auto rt = jit->getMainJITDylib().createResourceTracker();
+    if (auto err = addModule(*cg, rt))
+        return std::move(err);
+    return PendingExpression{std::move(rt), std::move(name)};
+}
+
+Expected<double> Kaleidoscope::runExpression(PendingExpression pending) {
+    auto sym = jit->lookup(StringRef(pending.name));
+    if (!sym) {
+        consumeError(pending.tracker->remove());
+        return sym.takeError();
+    }
+
+    double result;
+    switch (options.numeric) {
+        case num_f32:
+            result = jitTargetAddressToFunction<float (*)()>(sym->getAddress())();
+            break;
+        case num_i64:
+            result = jitTargetAddressToFunction<int64_t (*)()>(sym->getAddress())();
+            break;
+        default:
+            result = jitTargetAddressToFunction<double (*)()>(sym->getAddress())();
+    }
+
+    if (auto err = pending.tracker->remove())
+        return std::move(err);
+    return result;
+}
+
+const HashConsStats &Kaleidoscope::getHashConsStats() const {
+    return hashConser.getStats();
+}
+
+Expected<JITTargetAddress> Kaleidoscope::getAddress(const std::string &name, size_t arity,
+                                                    NumericMode mode) {
+    // externs are host C functions taking doubles
+    NumericMode actual = externs.count(name) ? num_f64 : options.numeric;
+    if (mode != actual)
+        return makeError("'" + name + "' is compiled for " + numericModeName(actual) +
+                         ", not " + numericModeName(mode));
+
+    reapBackground(&name);
+    auto proto = prototypes.find(name);
+    if (proto == prototypes.end())
+        return makeError("unknown function '" + name + "'");
+    if (proto->second->getArgs().size() != arity)
+        return makeError("'" + name + "' takes " +
+                         Twine(proto->second->getArgs().size()) + " arguments, not " +
+                         Twine(arity));
+
+    auto cached = addresses.find(name);
+    if (cached != addresses.end())
+        return cached->second;
+
+    // externs resolve against the host process on first use
+    auto sym = jit->lookup(StringRef(name));
+    if (!sym)
+        return sym.takeError();
+    addresses[name] = sym->getAddress();
+    return sym->getAddress();
+}
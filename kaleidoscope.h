@@ -0,0 +1,191 @@
+#ifndef KALEIDOSCOPE_H
+#define KALEIDOSCOPE_H
+
+#include "ast.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "hashcons.h"
+#include "KaleidoscopeJIT.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Error.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+// Embedding API for calling compiled Kaleidoscope functions from C++.
+// An instance must only be used from one thread at a time, except that
+// runExpression may run on another thread than the one adding code.
+//
+//   auto ks = cantFail(Kaleidoscope::Create());
+//   cantFail(ks->compile("def f(x y) x*y+1;"));
+//   auto f = cantFail(ks->getFunction<double(double, double)>("f"));
+//   double r = f(2, 3);
+
+template <typename T>
+struct NumericModeOf;
+
+template <>
+struct NumericModeOf<double> { static constexpr NumericMode value = num_f64; };
+
+template <>
+struct NumericModeOf<float> { static constexpr NumericMode value = num_f32; };
+
+template <>
+struct NumericModeOf<int64_t> { static constexpr NumericMode value = num_i64; };
+
+template <typename T, typename... Ts>
+struct AllSame : std::true_type {};
+
+template <typename T, typename U, typename... Ts>
+struct AllSame<T, U, Ts...>
+    : std::integral_constant<bool, std::is_same<T, U>::value && AllSame<T, Ts...>::value> {};
+
+template <typename Sig>
+class FunctionHandle;
+
+// A resolved function; calling it is a plain indirect call.
+template <typename R, typename... Args>
+class FunctionHandle<R(Args...)> {
+    private:
+        R (*fn)(Args...);
+    public:
+        explicit FunctionHandle(R (*fn)(Args...)) : fn(fn) {}
+        R operator()(Args... args) const { return fn(args...); }
+        R (*get() const)(Args...) { return fn; }
+};
+
+struct KaleidoscopeOptions {
+    // register JIT'd objects with GDB
+    bool gdbListener = false;
+    // write /tmp/perf-<pid>.map and a jitdump for perf
+    bool perfListeners = false;
+    // attach line info to every definition
+    bool debugInfo = false;
+    // count calls and time every function, see profile.h
+    bool profile = false;
+    // merge repeated subexpressions before codegen, see hashcons.h
+    bool hashcons = false;
+    // handles must use the matching C++ type: double, float or int64_t
+    NumericMode numeric = num_f64;
+    // print the IR of each module before it is JIT'd
+    bool printIR = false;
+    // Compile definitions on background threads instead of waiting for
+    // each one; a lookup then only waits for what it depends on.
+    bool concurrentCompile = false;
+    std::string sourceName = "<string>";
+};
+
+class CodeGenerator;
+
+// An expression added to the JIT but not run yet.
+struct PendingExpression {
+    llvm::orc::ResourceTrackerSP tracker;
+    std::string name;
+};
+
+class Kaleidoscope {
+    private:
+        KaleidoscopeOptions options;
+        std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
+        std::unique_ptr<SnapshotReader> prelude;
+        HashConser hashConser;
+        std::map<std::string, std::unique_ptr<PrototypeAST>> prototypes;
+        llvm::StringMap<llvm::JITTargetAddress> addresses;
+        llvm::StringSet<> defined;
+        // prototypes that name host C functions, see CodeGenerator::setExterns
+        llvm::StringSet<> externs;
+        unsigned moduleCount = 0;
+        unsigned expressionCount = 0;
+
+        std::unique_ptr<CodeGenerator> newCodeGenerator();
+        llvm::Error addModule(CodeGenerator &cg, llvm::orc::ResourceTrackerSP rt = nullptr,
+                              std::vector<std::string> *defined = nullptr);
+        llvm::Error declareExtern(std::unique_ptr<PrototypeAST> proto,
+                                  std::vector<std::string> *added);
+        // what one compileFunctions call changed, so it can be undone
+        struct Batch {
+            std::vector<std::string> added;
+            std::vector<std::string> names;
+            std::vector<std::string> unexterned;
+            std::vector<std::unique_ptr<PrototypeAST>> replaced;
+            llvm::orc::ResourceTrackerSP rt;
+        };
+
+        // a batch still compiling in concurrent mode; done is set from a JIT thread
+        struct BackgroundBatch {
+            Batch batch;
+            std::mutex lock;
+            std::condition_variable finished;
+            bool done = false;
+            bool failed = false;
+        };
+        std::vector<std::shared_ptr<BackgroundBatch>> background;
+
+        llvm::Error rollback(Batch &batch);
+        void reapBackground(const std::string *waitFor = nullptr);
+        llvm::Error compileFunctions(std::vector<std::unique_ptr<FunctionAST>> functions,
+                                     std::vector<std::string> added);
+        llvm::Expected<llvm::JITTargetAddress> getAddress(const std::string &name, size_t arity,
+                                                          NumericMode mode);
+    public:
+        Kaleidoscope(std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit, KaleidoscopeOptions options);
+        static llvm::Expected<std::unique_ptr<Kaleidoscope>> Create(
+            KaleidoscopeOptions options = KaleidoscopeOptions());
+
+        // Functions missing from every module are loaded from here on first call.
+        void setPrelude(std::unique_ptr<SnapshotReader> reader);
+
+        // Compiles definitions and externs. All sources of one call go
+        // into a single module and are resolved with one JIT lookup.
+        llvm::Error compile(const std::string &source);
+        llvm::Error compile(llvm::ArrayRef<std::string> sources);
+
+        // Already-parsed items, as the REPL reads them one at a time.
+        llvm::Error addFunction(std::unique_ptr<FunctionAST> fn);
+        llvm::Error addExtern(std::unique_ptr<PrototypeAST> proto);
+        // the result is converted to double whatever the numeric mode
+        llvm::Expected<double> evaluate(std::unique_ptr<FunctionAST> expr);
+
+        // evaluate in two steps. Each expression gets its own symbol, so
+        // several can be pending at once and run from another thread while
+        // this one keeps adding definitions.
+        llvm::Expected<PendingExpression> addExpression(std::unique_ptr<FunctionAST> expr);
+        llvm::Expected<double> runExpression(PendingExpression pending);
+
+        const HashConsStats &getHashConsStats() const;
+
+        template <typename Sig>
+        llvm::Expected<FunctionHandle<Sig>> getFunction(const std::string &name);
+};
+
+template <typename Sig>
+struct FunctionHandleTraits;
+
+template <typename R, typename... Args>
+struct FunctionHandleTraits<R(Args...)> {
+    static constexpr size_t arity = sizeof...(Args);
+    static constexpr bool valid = AllSame<R, Args...>::value;
+    static constexpr NumericMode mode = NumericModeOf<R>::value;
+};
+
+template <typename Sig>
+llvm::Expected<FunctionHandle<Sig>> Kaleidoscope::getFunction(const std::string &name) {
+    static_assert(FunctionHandleTraits<Sig>::valid,
+                  "Kaleidoscope functions take and return a single numeric type");
+
+    auto addr = getAddress(name, FunctionHandleTraits<Sig>::arity,
+                           FunctionHandleTraits<Sig>::mode);
+    if (!addr)
+        return addr.takeError();
+    return FunctionHandle<Sig>(llvm::jitTargetAddressToFunction<Sig *>(*addr));
+}
+
+#endif
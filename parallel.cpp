@@ -0,0 +1,204 @@
+#include "parallel.h"
+#include "error.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+// index of the pool worker running on this thread, if any
+static thread_local size_t workerIndex = 0;
+
+ThreadPool::ThreadPool(unsigned numThreads) {
+    for (unsigned i = 0; i < numThreads; ++i)
+        workers.push_back(std::make_unique<Worker>());
+    for (unsigned i = 0; i < numThreads; ++i)
+        threads.emplace_back([this, i] { workerLoop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads)
+        t.join();
+}
+
+size_t ThreadPool::size() const {
+    return workers.size();
+}
+
+ThreadPool &ThreadPool::global() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+// Takes a task from home's front, or else steals one from another back.
+bool ThreadPool::runOne(size_t home) {
+    std::function<void()> task;
+    for (size_t i = 0; i < workers.size() && !task; ++i) {
+        Worker &w = *workers[(home + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(w.lock);
+        if (w.tasks.empty())
+            continue;
+        if (i == 0) {
+            task = std::move(w.tasks.front());
+            w.tasks.pop_front();
+        } else {
+            task = std::move(w.tasks.back());
+            w.tasks.pop_back();
+        }
+    }
+    if (!task)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        --queued;
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(size_t id) {
+    workerIndex = id;
+    while (true) {
+        if (runOne(id))
+            continue;
+        std::unique_lock<std::mutex> guard(sleepLock);
+        wake.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping)
+            return;
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)> &body) {
+    if (count == 0)
+        return;
+
+    // counted before any task is visible, so a worker that takes one
+    // early cannot decrement queued below zero
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        queued += count;
+    }
+
+    std::atomic<size_t> remaining(count);
+    for (size_t i = 0; i < count; ++i) {
+        Worker &w = *workers[(workerIndex + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(w.lock);
+        w.tasks.push_back([&body, &remaining, i] {
+            body(i);
+            remaining.fetch_sub(1, std::memory_order_release);
+        });
+    }
+    wake.notify_all();
+
+    // help out rather than block, which also keeps nested calls from deadlocking
+    while (remaining.load(std::memory_order_acquire) > 0)
+        if (!runOne(workerIndex))
+            std::this_thread::yield();
+}
+
+SerialQueue::SerialQueue() : thread([this] { loop(); }) {}
+
+SerialQueue::~SerialQueue() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_one();
+    thread.join();
+}
+
+void SerialQueue::post(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(std::move(job));
+    }
+    changed.notify_one();
+}
+
+void SerialQueue::loop() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+// // Builtins
+
+// Sets n to the number of iterations from lo below hi. Fails for a range
+// that is not finite or has more iterations than fit in a size_t.
+template <typename T>
+static bool rangeLength(T lo, T hi, size_t &n) {
+    double len = std::ceil((double)hi - (double)lo);
+    if (std::isnan(len) || len >= 18446744073709551616.0) {
+        logError("parallel builtin range is not finite or too large");
+        return false;
+    }
+    n = len > 0 ? (size_t)len : 0;
+    return true;
+}
+
+// a few chunks per worker so stealing can even out uneven iterations
+static size_t chunkCount(size_t n) {
+    return std::min(n, ThreadPool::global().size() * 8);
+}
+
+// first iteration of chunk c; chunkBegin(n, chunks, chunks) == n
+static size_t chunkBegin(size_t n, size_t chunks, size_t c) {
+    return c * (n / chunks) + std::min(c, n % chunks);
+}
+
+template <typename T>
+T parallelSum(T (*f)(T), T lo, T hi) {
+    size_t n;
+    if (!rangeLength(lo, hi, n))
+        return 0;
+    size_t chunks = chunkCount(n);
+
+    // summed in chunk order so the result does not depend on scheduling
+    std::vector<T> partials(chunks);
+    ThreadPool::global().parallelFor(chunks, [&](size_t c) {
+        T sum = 0;
+        for (size_t i = chunkBegin(n, chunks, c), end = chunkBegin(n, chunks, c + 1); i < end; ++i)
+            sum += f(lo + i);
+        partials[c] = sum;
+    });
+
+    T sum = 0;
+    for (T partial : partials)
+        sum += partial;
+    return sum;
+}
+
+template <typename T>
+T parallelMap(T (*f)(T), T lo, T hi) {
+    size_t n;
+    if (!rangeLength(lo, hi, n))
+        return 0;
+    size_t chunks = chunkCount(n);
+
+    ThreadPool::global().parallelFor(chunks, [&](size_t c) {
+        for (size_t i = chunkBegin(n, chunks, c), end = chunkBegin(n, chunks, c + 1); i < end; ++i)
+            f(lo + i);
+    });
+    return 0;
+}
+
+template double parallelSum(double (*)(double), double, double);
+template float parallelSum(float (*)(float), float, float);
+template int64_t parallelSum(int64_t (*)(int64_t), int64_t, int64_t);
+template double parallelMap(double (*)(double), double, double);
+template float parallelMap(float (*)(float), float, float);
+template int64_t parallelMap(int64_t (*)(int64_t), int64_t, int64_t);
@@ -0,0 +1,74 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool behind the parallel builtins. Each worker pops from
+// the front of its own deque and steals from the back of the others'.
+// Threads waiting on a job run queued tasks meanwhile, so JIT'd code may
+// call a parallel builtin from inside one.
+class ThreadPool {
+    private:
+        struct Worker {
+            std::mutex lock;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<std::thread> threads;
+        std::mutex sleepLock;
+        std::condition_variable wake;
+        size_t queued = 0;
+        bool stopping = false;
+
+        bool runOne(size_t home);
+        void workerLoop(size_t id);
+    public:
+        ThreadPool(unsigned numThreads);
+        ~ThreadPool();
+        size_t size() const;
+
+        // Runs body(0) .. body(count - 1) across the pool and returns when
+        // all of them are done.
+        void parallelFor(size_t count, const std::function<void(size_t)> &body);
+
+        static ThreadPool &global();
+};
+
+// Runs jobs one at a time on a thread of its own, in the order they were
+// posted. The destructor finishes every job already posted.
+class SerialQueue {
+    private:
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<std::function<void()>> jobs;
+        bool stopping = false;
+        std::thread thread;
+
+        void loop();
+    public:
+        SerialQueue();
+        ~SerialQueue();
+        void post(std::function<void()> job);
+};
+
+// Builtins callable from Kaleidoscope, instantiated for double, float and
+// int64_t to match each NumericMode. f is applied to lo, lo+1, ... below hi.
+template <typename T>
+T parallelSum(T (*f)(T), T lo, T hi);
+// Applies f for its side effects and returns 0.
+template <typename T>
+T parallelMap(T (*f)(T), T lo, T hi);
+
+const char *const parallelSumSymbol = "parallel_sum";
+const char *const parallelMapSymbol = "parallel_map";
+
+#endif
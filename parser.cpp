@@ -11,16 +11,48 @@
 static std::string IdentifierStr;
 static double NumVal;
 
+// input is stdin unless a source string has been supplied
+static std::string inputStr;
+static size_t inputPos;
+static bool readFromString = false;
+static int lastChar = ' ';
+
+// line of the character in lastChar, and of the start of the current token
+static int curLine = 1;
+static int tokLine = 1;
+
+static int readChar() {
+    int c;
+    if (!readFromString)
+        c = getchar();
+    else if (inputPos >= inputStr.size())
+        c = EOF;
+    else
+        c = (unsigned char)inputStr[inputPos++];
+    if (lastChar == '\n')
+        curLine++;
+    return c;
+}
+
+void setInputString(const std::string &source) {
+    inputStr = source;
+    inputPos = 0;
+    readFromString = true;
+    lastChar = ' ';
+    curLine = 1;
+}
+
 static int gettok() {
-    static int lastChar = ' ';
 
     while (isspace(lastChar))
-        lastChar = getchar();
+        lastChar = readChar();
+
+    tokLine = curLine;
 
     // identifiers and keywords
     if (isalpha(lastChar)) {
         IdentifierStr = lastChar;
-        while (isalnum((lastChar = getchar())))
+        while (isalnum((lastChar = readChar())) || lastChar == '_')
             IdentifierStr += lastChar;
 
         if (IdentifierStr == "def")
@@ -30,12 +62,20 @@ static int gettok() {
         return tok_identifier;
     }
 
+    // repl commands, ':' followed by a name
+    if (lastChar == ':') {
+        IdentifierStr.clear();
+        while (isalnum((lastChar = readChar())) || lastChar == '-')
+            IdentifierStr += lastChar;
+        return tok_command;
+    }
+
     // numbers
     if (isdigit(lastChar) || lastChar == '.') {
         std::string numStr;
         do {
             numStr += lastChar;
-            lastChar = getchar();
+            lastChar = readChar();
         } while (isdigit(lastChar) || lastChar == '.');
 
         NumVal = strtod(numStr.c_str(), 0);
@@ -45,7 +85,7 @@ static int gettok() {
     // comments
     if (lastChar == '#') {
         do
-            lastChar = getchar();
+            lastChar = readChar();
         while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
 
         if (lastChar != EOF)
@@ -56,7 +96,7 @@ static int gettok() {
         return tok_eof;
 
     int thisChar = lastChar;
-    lastChar = getchar();
+    lastChar = readChar();
     return thisChar;
 }
 
@@ -68,6 +108,10 @@ int getNextToken() {
     return CurTok = gettok();
 }
 
+const std::string &currentIdentifier() {
+    return IdentifierStr;
+}
+
 static int getTokPrecedence() {
     if (!isascii(CurTok))
         return -1;
@@ -86,7 +130,7 @@ static int getTokPrecedence() {
 }
 
 std::unique_ptr<ExprAST> logErrorE(const char *str) {
-    logErrorE(str);
+    logError(str);
     return nullptr;
 }
 
@@ -211,6 +255,7 @@ std::unique_ptr<PrototypeAST> parsePrototype() {
         return logErrorP("Expected function name in prototype");
 
     std::string fnName = IdentifierStr;
+    int line = tokLine;
     getNextToken();
 
     if (CurTok != '(')
@@ -227,7 +272,7 @@ std::unique_ptr<PrototypeAST> parsePrototype() {
 
     getNextToken();
 
-    return std::make_unique<PrototypeAST>(fnName, std::move(argNames));
+    return std::make_unique<PrototypeAST>(fnName, std::move(argNames), line);
 }
 
 /// definition ::= 'def' prototype expression
@@ -250,8 +295,9 @@ std::unique_ptr<PrototypeAST> parseExtern() {
 
 /// toplevelexpr ::= expression
 std::unique_ptr<FunctionAST> parseTopLevelExpr() {
+    int line = tokLine;
     if (auto e = parseExpression()) {
-        auto proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+        auto proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>(), line);
         return std::make_unique<FunctionAST>(std::move(proto), std::move(e));
     }
     return nullptr;
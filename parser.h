@@ -12,10 +12,15 @@ enum Token {
 
     // primary
     tok_identifier = -4,
-    tok_number = -5
+    tok_number = -5,
+
+    // repl
+    tok_command = -6
 };
 
+void setInputString(const std::string &source);
 int getNextToken();
+const std::string &currentIdentifier();
 std::unique_ptr<ExprAST> parseNumberExpr();
 std::unique_ptr<ExprAST> parseParenExpr();
 std::unique_ptr<ExprAST> parseIdentifierExpr();
@@ -0,0 +1,198 @@
+#include "profile.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace llvm;
+
+namespace {
+
+struct Counters {
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> ticks;
+    std::atomic<uint64_t> histogram[profileBuckets];
+
+    Counters() { clear(); }
+
+    void clear() {
+        calls.store(0, std::memory_order_relaxed);
+        ticks.store(0, std::memory_order_relaxed);
+        for (auto &h : histogram)
+            h.store(0, std::memory_order_relaxed);
+    }
+};
+
+const unsigned chunkSize = 64;
+const unsigned numChunks = maxProfiledFunctions / chunkSize;
+
+// One per thread, allocated a chunk at a time as ids get used. Blocks are
+// never freed so counts survive the thread that made them.
+struct ThreadCounters {
+    std::atomic<Counters *> chunks[numChunks];
+
+    ThreadCounters() {
+        for (auto &c : chunks)
+            c.store(nullptr, std::memory_order_relaxed);
+    }
+};
+
+std::mutex registryLock;
+std::vector<std::string> functionNames;
+StringMap<unsigned> functionIds;
+std::vector<ThreadCounters *> threads;
+
+thread_local ThreadCounters *localCounters = nullptr;
+
+}
+
+static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const char *profileTickUnit() {
+#if defined(__x86_64__) || defined(__i386__)
+    return "cycles";
+#else
+    return "ns";
+#endif
+}
+
+// Only the owning thread writes, so a plain load and store is enough.
+static void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static Counters &countersFor(uint64_t id) {
+    if (!localCounters) {
+        localCounters = new ThreadCounters();
+        std::lock_guard<std::mutex> guard(registryLock);
+        threads.push_back(localCounters);
+    }
+
+    std::atomic<Counters *> &chunk = localCounters->chunks[id / chunkSize];
+    Counters *counters = chunk.load(std::memory_order_relaxed);
+    if (!counters) {
+        counters = new Counters[chunkSize];
+        chunk.store(counters, std::memory_order_release);
+    }
+    return counters[id % chunkSize];
+}
+
+uint64_t profileEnter() {
+    return now();
+}
+
+void profileExit(uint64_t id, uint64_t start) {
+    if (id >= maxProfiledFunctions)
+        return;
+
+    uint64_t elapsed = now() - start;
+    Counters &counters = countersFor(id);
+    bump(counters.calls, 1);
+    bump(counters.ticks, elapsed);
+    unsigned bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+    bump(counters.histogram[bucket], 1);
+}
+
+unsigned registerProfiledFunction(const std::string &name) {
+    std::lock_guard<std::mutex> guard(registryLock);
+    auto found = functionIds.find(name);
+    if (found != functionIds.end())
+        return found->second;
+
+    if (functionNames.size() >= maxProfiledFunctions)
+        return maxProfiledFunctions;
+    unsigned id = functionNames.size();
+    functionNames.push_back(name);
+    functionIds[name] = id;
+    return id;
+}
+
+std::vector<FunctionProfile> collectProfile() {
+    std::lock_guard<std::mutex> guard(registryLock);
+    std::vector<FunctionProfile> result(functionNames.size());
+    for (size_t id = 0; id < functionNames.size(); ++id)
+        result[id].name = functionNames[id];
+
+    for (ThreadCounters *thread : threads) {
+        for (size_t id = 0; id < functionNames.size(); ++id) {
+            Counters *chunk = thread->chunks[id / chunkSize].load(std::memory_order_acquire);
+            if (!chunk)
+                continue;
+            Counters &counters = chunk[id % chunkSize];
+            FunctionProfile &profile = result[id];
+            profile.calls += counters.calls.load(std::memory_order_relaxed);
+            profile.ticks += counters.ticks.load(std::memory_order_relaxed);
+            for (unsigned b = 0; b < profileBuckets; ++b)
+                profile.histogram[b] += counters.histogram[b].load(std::memory_order_relaxed);
+        }
+    }
+    return result;
+}
+
+// Counts a thread adds while this runs may survive the reset.
+void resetProfile() {
+    std::lock_guard<std::mutex> guard(registryLock);
+    for (ThreadCounters *thread : threads) {
+        for (auto &chunk : thread->chunks) {
+            Counters *counters = chunk.load(std::memory_order_acquire);
+            if (!counters)
+                continue;
+            for (unsigned i = 0; i < chunkSize; ++i)
+                counters[i].clear();
+        }
+    }
+}
+
+void printProfile(raw_ostream &os) {
+    for (auto &profile : collectProfile()) {
+        if (!profile.calls)
+            continue;
+        os << format("%-24s %12llu calls %14.1f %s/call\n", profile.name.c_str(),
+                     (unsigned long long)profile.calls,
+                     (double)profile.ticks / profile.calls, profileTickUnit());
+        for (unsigned b = 0; b < profileBuckets; ++b)
+            if (profile.histogram[b])
+                os << format("    < 2^%-2u %12llu\n", b + 1,
+                             (unsigned long long)profile.histogram[b]);
+    }
+}
+
+void printProfileJSON(raw_ostream &os) {
+    json::OStream j(os, 2);
+    j.object([&] {
+        j.attribute("tick_unit", profileTickUnit());
+        j.attributeArray("functions", [&] {
+            for (auto &profile : collectProfile()) {
+                j.object([&] {
+                    j.attribute("name", profile.name);
+                    j.attribute("calls", (int64_t)profile.calls);
+                    j.attribute("ticks", (int64_t)profile.ticks);
+                    // histogram[k] counts calls that took [2^k, 2^(k+1)) ticks
+                    unsigned last = profileBuckets;
+                    while (last > 0 && !profile.histogram[last - 1])
+                        --last;
+                    j.attributeArray("histogram", [&] {
+                        for (unsigned b = 0; b < last; ++b)
+                            j.value((int64_t)profile.histogram[b]);
+                    });
+                });
+            }
+        });
+    });
+    os << "\n";
+}
@@ -0,0 +1,45 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Call counts and latency histograms for JIT'd functions.
+//
+// Code compiled in profiling mode calls __ks_profile_enter on entry and
+// __ks_profile_exit before returning. Each thread only ever writes its own
+// counters, so the hot path takes no locks; readers add up every thread.
+// Ids are by function name and shared by everything in the process.
+
+const unsigned profileBuckets = 64;
+const unsigned maxProfiledFunctions = 1 << 16;
+
+struct FunctionProfile {
+    std::string name;
+    uint64_t calls = 0;
+    uint64_t ticks = 0;
+    // histogram[k] counts calls that took [2^k, 2^(k+1)) ticks
+    uint64_t histogram[profileBuckets] = {};
+};
+
+// Returns maxProfiledFunctions once the table is full.
+unsigned registerProfiledFunction(const std::string &name);
+
+std::vector<FunctionProfile> collectProfile();
+void resetProfile();
+const char *profileTickUnit();
+
+void printProfile(llvm::raw_ostream &os);
+void printProfileJSON(llvm::raw_ostream &os);
+
+// entry points for instrumented code, and the names the JIT defines them as
+uint64_t profileEnter();
+void profileExit(uint64_t id, uint64_t start);
+
+const char *const profileEnterSymbol = "__ks_profile_enter";
+const char *const profileExitSymbol = "__ks_profile_exit";
+
+#endif
@@ -0,0 +1,325 @@
+#include "snapshot.h"
+#include "error.h"
+
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static const char snapshotMagic[4] = {'K', 'S', 'N', 'P'};
+static const uint32_t snapshotVersion = 1;
+
+enum SnapshotTag : uint8_t {
+    tag_number = 1,
+    tag_variable,
+    tag_binary,
+    tag_call,
+    tag_prototype,
+    tag_function
+};
+
+// // Writing
+
+static void writeU8(std::string &out, uint8_t v) {
+    out.push_back(v);
+}
+
+static void writeU32(std::string &out, uint32_t v) {
+    raw_string_ostream os(out);
+    support::endian::write(os, v, support::little);
+}
+
+static void writeU64(std::string &out, uint64_t v) {
+    raw_string_ostream os(out);
+    support::endian::write(os, v, support::little);
+}
+
+// lengths and counts are ULEB128 so short names stay short
+static void writeULEB(std::string &out, uint64_t v) {
+    raw_string_ostream os(out);
+    encodeULEB128(v, os);
+}
+
+static void writeString(std::string &out, const std::string &s) {
+    writeULEB(out, s.size());
+    out += s;
+}
+
+void SnapshotWriter::visitNumberExpr(double val) {
+    writeU8(payloads, tag_number);
+    writeU64(payloads, DoubleToBits(val));
+}
+
+void SnapshotWriter::visitVariableExpr(std::string name) {
+    writeU8(payloads, tag_variable);
+    writeString(payloads, name);
+}
+
+void SnapshotWriter::visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) {
+    writeU8(payloads, tag_binary);
+    writeU8(payloads, op);
+    lhs->accept(this);
+    rhs->accept(this);
+}
+
+void SnapshotWriter::visitCallExpr(std::string callee, const std::vector<std::unique_ptr<ExprAST>> &args) {
+    writeU8(payloads, tag_call);
+    writeString(payloads, callee);
+    writeULEB(payloads, args.size());
+    for (auto &arg : args)
+        arg->accept(this);
+}
+
+// snapshots store plain trees, so shared nodes are written out in full
+void SnapshotWriter::visitSharedExpr(ExprAST *expr) {
+    expr->accept(this);
+}
+
+void SnapshotWriter::visitPrototype(std::string name, const std::vector<std::string> &args) {
+    currentName = name;
+    writeU8(payloads, tag_prototype);
+    writeString(payloads, name);
+    writeULEB(payloads, args.size());
+    for (auto &arg : args)
+        writeString(payloads, arg);
+}
+
+void SnapshotWriter::visitFunction(PrototypeAST *proto, ExprAST *body) {
+    writeU8(payloads, tag_function);
+    proto->accept(this);
+    body->accept(this);
+}
+
+void SnapshotWriter::add(DeclAST *decl) {
+    uint64_t start = payloads.size();
+    decl->accept(this);
+    index.push_back({currentName, {start, payloads.size() - start}});
+}
+
+bool SnapshotWriter::write(const std::string &path) {
+    uint64_t headerSize = sizeof(snapshotMagic) + 2 * sizeof(uint32_t);
+    for (auto &entry : index)
+        headerSize += getULEB128Size(entry.first.size()) + entry.first.size() +
+                      2 * sizeof(uint64_t);
+
+    std::string header(snapshotMagic, sizeof(snapshotMagic));
+    writeU32(header, snapshotVersion);
+    writeU32(header, index.size());
+    for (auto &entry : index) {
+        writeString(header, entry.first);
+        writeU64(header, headerSize + entry.second.first);
+        writeU64(header, entry.second.second);
+    }
+
+    std::error_code ec;
+    raw_fd_ostream os(path, ec, sys::fs::OF_None);
+    if (ec) {
+        logError("Could not open snapshot file for writing");
+        return false;
+    }
+    os << header << payloads;
+    os.close();
+    if (os.has_error()) {
+        logError("Could not write snapshot file");
+        os.clear_error();
+        return false;
+    }
+    return true;
+}
+
+// // Reading
+
+namespace {
+
+// Bounds-checked cursor over one payload; any overrun sets failed.
+struct Cursor {
+    const char *ptr;
+    const char *end;
+    bool failed = false;
+
+    bool has(size_t n) {
+        if (failed || (size_t)(end - ptr) < n)
+            failed = true;
+        return !failed;
+    }
+
+    uint8_t u8() {
+        if (!has(1))
+            return 0;
+        return *ptr++;
+    }
+
+    uint32_t u32() {
+        if (!has(4))
+            return 0;
+        uint32_t v = support::endian::read32le(ptr);
+        ptr += 4;
+        return v;
+    }
+
+    uint64_t u64() {
+        if (!has(8))
+            return 0;
+        uint64_t v = support::endian::read64le(ptr);
+        ptr += 8;
+        return v;
+    }
+
+    uint64_t uleb() {
+        if (failed)
+            return 0;
+        unsigned n = 0;
+        const char *error = nullptr;
+        uint64_t v = decodeULEB128((const uint8_t *)ptr, &n,
+                                   (const uint8_t *)end, &error);
+        if (error) {
+            failed = true;
+            return 0;
+        }
+        ptr += n;
+        return v;
+    }
+
+    std::string str() {
+        uint64_t len = uleb();
+        if (!has(len))
+            return std::string();
+        std::string s(ptr, len);
+        ptr += len;
+        return s;
+    }
+};
+
+}
+
+static std::unique_ptr<ExprAST> readExpr(Cursor &c) {
+    switch (c.u8()) {
+        case tag_number:
+            return std::make_unique<NumberExprAST>(BitsToDouble(c.u64()));
+        case tag_variable:
+            return std::make_unique<VariableExprAST>(c.str());
+        case tag_binary: {
+            char op = c.u8();
+            auto lhs = readExpr(c);
+            if (!lhs)
+                return nullptr;
+            auto rhs = readExpr(c);
+            if (!rhs)
+                return nullptr;
+            return std::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs));
+        }
+        case tag_call: {
+            std::string callee = c.str();
+            uint64_t n = c.uleb();
+            std::vector<std::unique_ptr<ExprAST>> args;
+            for (uint64_t i = 0; i < n && !c.failed; ++i) {
+                auto arg = readExpr(c);
+                if (!arg)
+                    return nullptr;
+                args.push_back(std::move(arg));
+            }
+            return std::make_unique<CallExprAST>(callee, std::move(args));
+        }
+    }
+    c.failed = true;
+    return nullptr;
+}
+
+static std::unique_ptr<PrototypeAST> readPrototype(Cursor &c) {
+    if (c.u8() != tag_prototype) {
+        c.failed = true;
+        return nullptr;
+    }
+    std::string name = c.str();
+    uint64_t n = c.uleb();
+    std::vector<std::string> args;
+    for (uint64_t i = 0; i < n && !c.failed; ++i)
+        args.push_back(c.str());
+    return std::make_unique<PrototypeAST>(name, std::move(args));
+}
+
+std::unique_ptr<SnapshotReader> SnapshotReader::open(const std::string &path) {
+    // large files are mmapped rather than read
+    auto buf = MemoryBuffer::getFile(path, /*IsText=*/false,
+                                     /*RequiresNullTerminator=*/false);
+    if (!buf) {
+        logError("Could not open snapshot file");
+        return nullptr;
+    }
+
+    auto reader = std::make_unique<SnapshotReader>();
+    reader->buffer = std::move(*buf);
+
+    Cursor c{reader->buffer->getBufferStart(), reader->buffer->getBufferEnd()};
+    if (!c.has(sizeof(snapshotMagic)) ||
+            memcmp(c.ptr, snapshotMagic, sizeof(snapshotMagic)) != 0) {
+        logError("Not a snapshot file");
+        return nullptr;
+    }
+    c.ptr += sizeof(snapshotMagic);
+
+    if (c.u32() != snapshotVersion) {
+        logError("Unsupported snapshot version");
+        return nullptr;
+    }
+
+    uint32_t count = c.u32();
+    uint64_t fileSize = reader->buffer->getBufferSize();
+    for (uint32_t i = 0; i < count && !c.failed; ++i) {
+        std::string name = c.str();
+        uint64_t offset = c.u64();
+        uint64_t size = c.u64();
+        if (offset > fileSize || size > fileSize - offset)
+            c.failed = true;
+        reader->index[name] = {offset, size};
+    }
+
+    if (c.failed) {
+        logError("Corrupt snapshot index");
+        return nullptr;
+    }
+    return reader;
+}
+
+bool SnapshotReader::contains(StringRef name) const {
+    return index.count(name);
+}
+
+size_t SnapshotReader::size() const {
+    return index.size();
+}
+
+std::unique_ptr<DeclAST> SnapshotReader::load(StringRef name) const {
+    auto entry = index.find(name);
+    if (entry == index.end())
+        return nullptr;
+
+    const char *start = buffer->getBufferStart() + entry->second.first;
+    Cursor c{start, start + entry->second.second};
+
+    std::unique_ptr<DeclAST> result;
+    switch (c.u8()) {
+        case tag_prototype:
+            c.ptr = start;
+            result = readPrototype(c);
+            break;
+        case tag_function: {
+            auto proto = readPrototype(c);
+            auto body = readExpr(c);
+            if (proto && body)
+                result = std::make_unique<FunctionAST>(std::move(proto), std::move(body));
+            break;
+        }
+        default:
+            c.failed = true;
+    }
+
+    if (c.failed) {
+        logError("Corrupt snapshot entry");
+        return nullptr;
+    }
+    return result;
+}
@@ -0,0 +1,53 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "ast.h"
+#include "visitor.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Binary snapshot of parsed declarations, so a prelude can be reloaded
+// without going back through the lexer and parser.
+//
+// layout (fixed-width integers little endian, lengths ULEB128):
+//   "KSNP" | u32 version | u32 count
+//   count x { uleb nameLen | name | u64 offset | u64 size }
+//   payloads, one serialized DeclAST per index entry
+
+class SnapshotWriter : public ASTVisitor {
+    private:
+        std::string payloads;
+        std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> index;
+        std::string currentName;
+    public:
+        void add(DeclAST *decl);
+        bool write(const std::string &path);
+
+        void visitNumberExpr(double val) override;
+        void visitVariableExpr(std::string name) override;
+        void visitBinaryExpr(char op, ExprAST *lhs, ExprAST *rhs) override;
+        void visitCallExpr(std::string callee, const std::vector<std::unique_ptr<ExprAST>> &args) override;
+        void visitSharedExpr(ExprAST *expr) override;
+        void visitPrototype(std::string name, const std::vector<std::string> &args) override;
+        void visitFunction(PrototypeAST *proto, ExprAST *body) override;
+};
+
+// Maps a snapshot file and decodes single declarations on demand.
+class SnapshotReader {
+    private:
+        std::unique_ptr<llvm::MemoryBuffer> buffer;
+        llvm::StringMap<std::pair<uint64_t, uint64_t>> index;
+    public:
+        static std::unique_ptr<SnapshotReader> open(const std::string &path);
+        bool contains(llvm::StringRef name) const;
+        size_t size() const;
+        std::unique_ptr<DeclAST> load(llvm::StringRef name) const;
+};
+
+#endif